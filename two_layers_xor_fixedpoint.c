@@ -2,19 +2,59 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <math.h>
 #include <time.h>
+#include <limits.h>
+
+// Counts the malloc/calloc/realloc calls of every object linked into the
+// program, so tests can check that the training and evaluation loops stay
+// allocation-free after setup. The hook is interposed at link time with
+//   -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc
+// (see README); libc's own internal allocations are not seen. Without the
+// flags the __real_ symbols stay NULL and the check reports itself skipped.
+static long alloc_count = 0;
+
+extern void* __real_malloc(size_t size) __attribute__((weak));
+extern void* __real_calloc(size_t n, size_t size) __attribute__((weak));
+extern void* __real_realloc(void *ptr, size_t size) __attribute__((weak));
+
+void* __wrap_malloc(size_t size) {
+	alloc_count++;
+	return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+	alloc_count++;
+	return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void *ptr, size_t size) {
+	alloc_count++;
+	return __real_realloc(ptr, size);
+}
 
+int allocHookLinked() {
+	return __real_malloc != NULL;
+}
+
+// values are int8 with 32 == 1.0; gradients get int16 so mixed-precision
+// training can apply a loss scale without wrapping
 typedef struct {
-	char value;
-	char grad;
+	signed char value;
+	short grad;
 } Unit;
 
+short saturate_grad(int g) {
+	return g > SHRT_MAX ? SHRT_MAX : g < SHRT_MIN ? SHRT_MIN : g;
+}
+
 typedef struct multiplyGate{
 	Unit *u0;
 	Unit *u1;
 	Unit utop;
+	char grad_shift; // 5 rescales gradients like the forward /32, 0 keeps the raw product
 	Unit (*(*forward)(struct multiplyGate *this, Unit *u0, Unit *u1));
 	void (*backward)(struct multiplyGate *this);
 } multiplyGate;
@@ -30,14 +70,25 @@ Unit* forward_multiplyGate(multiplyGate *this, Unit *u0, Unit *u1) {
 }
 
 void backward_multiplyGate(multiplyGate *this) {
+	if(this->grad_shift) {
+		int scale = 1 << this->grad_shift;
+		this->u0->grad = saturate_grad(this->u0->grad + (this->u1->value * this->utop.grad)/scale);
+		this->u1->grad = saturate_grad(this->u1->grad + (this->u0->value * this->utop.grad)/scale);
+		return;
+	}
 	this->u0->grad += this->u1->value * this->utop.grad;
 	this->u1->grad += this->u0->value * this->utop.grad;
 }
 
+void init_multiplyGate(multiplyGate *this) {
+	this->grad_shift = 0;
+	this->forward = forward_multiplyGate;
+	this->backward = backward_multiplyGate;
+}
+
 multiplyGate* new_multiplyGate() {
 	multiplyGate *mulg0 = malloc(sizeof(multiplyGate));
-	mulg0->forward = forward_multiplyGate;
-	mulg0->backward = backward_multiplyGate;
+	init_multiplyGate(mulg0);
 	return mulg0;
 }
 
@@ -62,52 +113,157 @@ void backward_addGate(addGate *this) {
 	this->u1->grad += 1 * this->utop.grad;
 }
 
+void init_addGate(addGate *this) {
+	this->forward = forward_addGate;
+	this->backward = backward_addGate;
+}
+
 addGate* new_addGate() {
 	addGate *addg0 = malloc(sizeof(addGate));
-	addg0->forward = forward_addGate;
-	addg0->backward = backward_addGate;
+	init_addGate(addg0);
 	return addg0;
 }
 
-typedef struct ReLuGate {
-	Unit *u0;
-	Unit utop;
-	char (* ReLu)(char x);
-	Unit (*(*forward)(struct ReLuGate *this, Unit *u0));
-	void (*backward)(struct ReLuGate *this);
-} ReLuGate;
+// Activations are defined on real numbers and tabulated once over all 256
+// int8 inputs, so the fused forward+backward kernel is a single lookup that
+// yields both f(x) and f'(x) (both Q5, 32 == 1.0).
+typedef struct ActivationEntry {
+	signed char value;
+	signed char dfdx;
+} ActivationEntry;
+
+typedef struct Activation {
+	const char *name;
+	float (*fused)(float x, float *dfdx);
+	int ready;
+	ActivationEntry table[256]; // indexed by input + 128
+} Activation;
+
+float ReLu(float x) {
+	return x > 1 ? 1 : x > 0 ? x : 0;
+}
+
+float fused_ReLu(float x, float *dfdx) {
+	// the gradient is passed above the clamp too, as the original gate did
+	*dfdx = x > 0 ? 1 : 0;
+	return ReLu(x);
+}
+
+float fused_ReLuUnclamped(float x, float *dfdx) {
+	*dfdx = x > 0 ? 1 : 0;
+	return x > 0 ? x : 0;
+}
+
+// 2/32, the same slope as the float build
+#define LEAKY_SLOPE (1.0f/16)
+
+float fused_leakyReLu(float x, float *dfdx) {
+	*dfdx = x > 0 ? 1 : LEAKY_SLOPE;
+	return x > 0 ? x : LEAKY_SLOPE * x;
+}
+
+float fused_tanh(float x, float *dfdx) {
+	float t = tanhf(x);
+	*dfdx = 1 - t * t;
+	return t;
+}
+
+float fused_softsign(float x, float *dfdx) {
+	float d = 1 + fabsf(x);
+	*dfdx = 1 / (d * d);
+	return x / d;
+}
+
+float fused_GELU(float x, float *dfdx) {
+	// tanh approximation
+	const float k = 0.7978845608f; // sqrt(2/pi)
+	float t = tanhf(k * (x + 0.044715f * x * x * x));
+	*dfdx = 0.5f * (1 + t) + 0.5f * x * (1 - t * t) * k * (1 + 3 * 0.044715f * x * x);
+	return 0.5f * x * (1 + t);
+}
+
+Activation ReLuActivation = { "relu", fused_ReLu, 0, {{0}} };
+Activation ReLuUnclampedActivation = { "relu-unclamped", fused_ReLuUnclamped, 0, {{0}} };
+Activation leakyReLuActivation = { "leaky-relu", fused_leakyReLu, 0, {{0}} };
+Activation tanhActivation = { "tanh", fused_tanh, 0, {{0}} };
+Activation softsignActivation = { "softsign", fused_softsign, 0, {{0}} };
+Activation GELUActivation = { "gelu", fused_GELU, 0, {{0}} };
+
+Activation *activationList[] = {
+	&ReLuActivation, &ReLuUnclampedActivation, &leakyReLuActivation,
+	&tanhActivation, &softsignActivation, &GELUActivation,
+};
+
+signed char saturate_char(float v) {
+	long q = lrintf(v);
+	return q > 127 ? 127 : q < -128 ? -128 : (signed char)q;
+}
+
+void buildActivationTable(Activation *act) {
+	for(int x = -128; x < 128; x++) {
+		float dfdx;
+		float f = act->fused(x/32.0, &dfdx);
+		act->table[x + 128].value = saturate_char(f*(32));
+		act->table[x + 128].dfdx = saturate_char(dfdx*(32));
+	}
+	act->ready = 1;
+}
 
-char ReLu(char x) {
-	return x > 32 ? 32 : x > 0 ? x : 0;
+Activation* findActivation(const char *name) {
+	for(size_t i = 0; i < sizeof(activationList)/sizeof(activationList[0]); i++) {
+		if(strcmp(activationList[i]->name, name) == 0)
+			return activationList[i];
+	}
+	return NULL;
 }
 
-Unit* forward_ReLuGate(ReLuGate *this, Unit *u0) {
+typedef struct activationGate {
+	Unit *u0;
+	Unit utop;
+	signed char dfdx; // f'(u0) from the last forward, Q5
+	Activation *act;
+	Unit (*(*forward)(struct activationGate *this, Unit *u0));
+	void (*backward)(struct activationGate *this);
+} activationGate;
+
+Unit* forward_activationGate(activationGate *this, Unit *u0) {
+	ActivationEntry e = this->act->table[u0->value + 128];
 	this->u0 = u0;
-	this->utop.value = this->ReLu(u0->value);
+	this->utop.value = e.value;
+	this->dfdx = e.dfdx;
 	this->utop.grad = 0;
 	return &this->utop;
 }
 
-void backward_ReLuGate(ReLuGate *this) {
-	char s = this->ReLu(this->u0->value);
-	this->u0->grad += (s > 0 ? 1 : 0) * this->utop.grad;
+void backward_activationGate(activationGate *this) {
+	this->u0->grad += (this->dfdx * this->utop.grad)/32;
+}
+
+void setActivation_Gate(activationGate *this, Activation *act) {
+	if(!act->ready)
+		buildActivationTable(act);
+	this->act = act;
 }
 
-ReLuGate* new_ReLuGate() {
-	ReLuGate *reluGate = malloc(sizeof(ReLuGate));
-	reluGate->ReLu = ReLu;
-	reluGate->forward = forward_ReLuGate;
-	reluGate->backward = backward_ReLuGate;
-	return reluGate;
+void init_activationGate(activationGate *this, Activation *act) {
+	setActivation_Gate(this, act);
+	this->forward = forward_activationGate;
+	this->backward = backward_activationGate;
 }
 
+activationGate* new_activationGate(Activation *act) {
+	activationGate *gate = malloc(sizeof(activationGate));
+	init_activationGate(gate, act);
+	return gate;
+}
 
 typedef struct Circuit {
-	multiplyGate *mulg0;
-	multiplyGate *mulg1;
-	addGate *addg0;
-	addGate *addg1;
-	ReLuGate *sGate;
+	// gates live inside the circuit so a model is one contiguous block
+	multiplyGate mulg0;
+	multiplyGate mulg1;
+	addGate addg0;
+	addGate addg1;
+	activationGate sGate;
 
 	Unit *ax;
 	Unit *by;
@@ -116,39 +272,43 @@ typedef struct Circuit {
 	Unit *sValue;
 
 	Unit (*(*forward)(struct Circuit *this, Unit *x, Unit *y, Unit *a, Unit *b, Unit *c));
-	void (*backward)(struct Circuit *this, char gradient_top);
+	void (*backward)(struct Circuit *this, short gradient_top);
 } Circuit;
 
-void init_Circuit(struct Circuit *this) {
-	this->mulg0 = new_multiplyGate();
-	this->mulg1 = new_multiplyGate();
-	this->addg0 = new_addGate();
-	this->addg1 = new_addGate();
-	this->sGate = new_ReLuGate();
-}
-
 Unit* forward_Circuit(Circuit *this, Unit *x, Unit *y, Unit *a, Unit *b, Unit *c) {
-	this->ax = this->mulg0->forward(this->mulg0, a, x); // a*x
-	this->by = this->mulg1->forward(this->mulg1, b, y); // b*y
-	this->axpby = this->addg0->forward(this->addg0, this->ax, this->by); // a*x + b*y
-	this->axpbypc = this->addg1->forward(this->addg1, this->axpby, c); // a*x + b*y + c
-	this->sValue = this->sGate->forward(this->sGate, this->axpbypc);
+	this->ax = this->mulg0.forward(&this->mulg0, a, x); // a*x
+	this->by = this->mulg1.forward(&this->mulg1, b, y); // b*y
+	this->axpby = this->addg0.forward(&this->addg0, this->ax, this->by); // a*x + b*y
+	this->axpbypc = this->addg1.forward(&this->addg1, this->axpby, c); // a*x + b*y + c
+	this->sValue = this->sGate.forward(&this->sGate, this->axpbypc);
 	return this->sValue;
 }
 
-void backward_Circuit(struct Circuit *this, char gradient_top) {
+void backward_Circuit(struct Circuit *this, short gradient_top) {
 	this->sValue->grad = gradient_top;
-	this->sGate->backward(this->sGate);
-	this->addg1->backward(this->addg1); // sets gradient in axpby and c
-	this->addg0->backward(this->addg0); // sets gradient in ax and by
-	this->mulg1->backward(this->mulg1); // sets gradient in b and y
-	this->mulg0->backward(this->mulg0); // sets gradient in a and x
+	this->sGate.backward(&this->sGate);
+	this->addg1.backward(&this->addg1); // sets gradient in axpby and c
+	this->addg0.backward(&this->addg0); // sets gradient in ax and by
+	this->mulg1.backward(&this->mulg1); // sets gradient in b and y
+	this->mulg0.backward(&this->mulg0); // sets gradient in a and x
+}
+
+void init_Circuit(struct Circuit *this) {
+	init_multiplyGate(&this->mulg0);
+	init_multiplyGate(&this->mulg1);
+	init_addGate(&this->addg0);
+	init_addGate(&this->addg1);
+	init_activationGate(&this->sGate, &ReLuActivation);
+	this->forward = forward_Circuit;
+	this->backward = backward_Circuit;
+}
+
+void setActivation_Circuit(Circuit *this, Activation *act) {
+	setActivation_Gate(&this->sGate, act);
 }
 
 Circuit* new_Circuit() {
 	Circuit *circuit = malloc(sizeof(Circuit));
-	circuit->forward = forward_Circuit;
-	circuit->backward = backward_Circuit;
 	init_Circuit(circuit);
 	return circuit;
 }
@@ -173,6 +333,36 @@ void TestCircuit2() {
 }
 
 
+void TestActivations() {
+	// the tables must match the real-valued definitions to within a quantum
+	for(size_t k = 0; k < sizeof(activationList)/sizeof(activationList[0]); k++) {
+		Activation *act = activationList[k];
+		activationGate gate;
+		init_activationGate(&gate, act);
+		for(int v = -96; v <= 96; v += 8) {
+			Unit u = { .value = v, 0 };
+			float dfdx;
+			float f = act->fused(v/32.0, &dfdx);
+			gate.forward(&gate, &u);
+			assert(fabsf(gate.utop.value - f*(32)) <= 0.5f);
+			gate.utop.grad = 1024;
+			gate.backward(&gate);
+			assert(fabsf(u.grad - dfdx*1024) <= 32);
+		}
+		assert(findActivation(act->name) == act);
+	}
+	// the clamped ReLu is exactly the original gate
+	activationGate relu;
+	init_activationGate(&relu, &ReLuActivation);
+	for(int v = -128; v < 128; v++) {
+		Unit u = { .value = v, 0 };
+		relu.forward(&relu, &u);
+		assert(relu.utop.value == (v > 32 ? 32 : v > 0 ? v : 0));
+	}
+
+	printf("TestActivations [passed]\n");
+}
+
 void TestCircuit() {
 	printf("TestCircuit: ReLu\n");
 
@@ -222,11 +412,14 @@ typedef struct SVM {
 	
 	Unit *unit_c1out;
 	Unit *unit_c2out;
-	Unit unit_out;
+	Unit *unit_out;
+	short loss_scale;
+	float margin_hi; // positives scoring below this are pulled up
+	float margin_lo; // negatives scoring above this are pulled down
 	
-	Circuit *circuit1;
-	Circuit *circuit2;
-	Circuit *circuit3;
+	Circuit circuit1;
+	Circuit circuit2;
+	Circuit circuit3;
 	
 	Unit (*(*forward)(struct SVM *this, Unit *x, Unit *y));
 	void (*backward)(struct SVM *this, int label);
@@ -235,10 +428,10 @@ typedef struct SVM {
 } SVM;
 
 Unit* forward_SVM(SVM *this, Unit *x, Unit *y) {
-	this->unit_c1out = this->circuit1->forward(this->circuit1, x, y, &this->a1, &this->b1, &this->c1);
-	this->unit_c2out = this->circuit2->forward(this->circuit2, x, y, &this->a2, &this->b2, &this->c2);
-	this->unit_out = *this->circuit3->forward(this->circuit3, this->unit_c1out, this->unit_c2out, &this->a3, &this->b3, &this->c3);
-	return &this->unit_out;
+	this->unit_c1out = this->circuit1.forward(&this->circuit1, x, y, &this->a1, &this->b1, &this->c1);
+	this->unit_c2out = this->circuit2.forward(&this->circuit2, x, y, &this->a2, &this->b2, &this->c2);
+	this->unit_out = this->circuit3.forward(&this->circuit3, this->unit_c1out, this->unit_c2out, &this->a3, &this->b3, &this->c3);
+	return this->unit_out;
 }
 
 void backward_SVM(SVM *this, int label) {
@@ -256,16 +449,16 @@ void backward_SVM(SVM *this, int label) {
 
 	int pull = 0;
 
-	if(label == 1 && this->unit_out.value < 0.7*(32)) { 
+	if(label == 1 && this->unit_out->value < this->margin_hi*(32)) { 
 	  pull = 1; // the score was too low: pull up
 	}
-	if(label == 0 && this->unit_out.value > 0.3*(32)) {
+	if(label == 0 && this->unit_out->value > this->margin_lo*(32)) {
 	  pull = -1; // the score was too high for a positive example, pull down
 	}
 
-	this->circuit3->backward(this->circuit3, pull);
-	this->circuit2->backward(this->circuit2, pull);
-	this->circuit1->backward(this->circuit1, pull);
+	this->circuit3.backward(&this->circuit3, pull * this->loss_scale);
+	this->circuit2.backward(&this->circuit2, pull * this->loss_scale);
+	this->circuit1.backward(&this->circuit1, pull * this->loss_scale);
 }
 
 void parameterUpdate(SVM *this) {
@@ -295,13 +488,16 @@ char getRandomArbitrary(float min, float max) {
 }
 
 void init_SVM(SVM *svm) {
-	svm->circuit1 = new_Circuit();
-	svm->circuit2 = new_Circuit();
-	svm->circuit3 = new_Circuit();
+	init_Circuit(&svm->circuit1);
+	init_Circuit(&svm->circuit2);
+	init_Circuit(&svm->circuit3);
 	svm->forward = forward_SVM;
 	svm->backward = backward_SVM;
 	svm->parameterUpdate = parameterUpdate;
 	svm->learnFrom = learnFrom;
+	svm->loss_scale = 1;
+	svm->margin_hi = 0.7;
+	svm->margin_lo = 0.3;
 	
 	svm->a1.value = getRandomArbitrary(0, 1);
 	svm->a1.grad = 0;
@@ -325,6 +521,90 @@ void init_SVM(SVM *svm) {
 	svm->c3.grad = 0;
 }
 
+// Mixed precision: forward and backward stay in int8/int16, but the update is
+// accumulated into float master weights and requantized with stochastic
+// rounding, so steps smaller than one 1/32 quantum are not lost.
+typedef struct MasterWeights {
+	float a1, b1, c1;
+	float a2, b2, c2;
+	float a3, b3, c3;
+	float step_size;
+	int clean_steps; // steps since the loss scale last changed
+} MasterWeights;
+
+signed char stochasticRound(float w) {
+	float q = floorf(w*(32) + (float)rand()/((float)RAND_MAX + 1));
+	return q > 127 ? 127 : q < -128 ? -128 : (signed char)q;
+}
+
+int gradOverflowed(Unit *u) {
+	return u->grad == SHRT_MAX || u->grad == SHRT_MIN;
+}
+
+void updateMaster(float *master, Unit *u, float step) {
+	*master += step * u->grad;
+	// keep the master inside what the int8 forward can represent
+	*master = *master > 127/32.0 ? 127/32.0 : *master < -128/32.0 ? -128/32.0 : *master;
+	u->value = stochasticRound(*master);
+}
+
+void setGradShift_Circuit(Circuit *circuit, char shift) {
+	circuit->mulg0.grad_shift = shift;
+	circuit->mulg1.grad_shift = shift;
+}
+
+void init_MixedPrecision(SVM *svm, MasterWeights *m) {
+	setGradShift_Circuit(&svm->circuit1, 5);
+	setGradShift_Circuit(&svm->circuit2, 5);
+	setGradShift_Circuit(&svm->circuit3, 5);
+	// gradients are Q5, so this is 32.0 in real units
+	svm->loss_scale = 1024;
+	// Random_Test_XOR draws from the training distribution and passes at
+	// 0.7, the default margin, so a model trained to 0.7 is left on the
+	// threshold and a quantum of rounding fails its corner inputs; the float
+	// model fails the same test the same way. Training past it leaves room.
+	svm->margin_hi = 0.9;
+	svm->margin_lo = 0.1;
+
+	m->a1 = svm->a1.value/32.0; m->b1 = svm->b1.value/32.0; m->c1 = svm->c1.value/32.0;
+	m->a2 = svm->a2.value/32.0; m->b2 = svm->b2.value/32.0; m->c2 = svm->c2.value/32.0;
+	m->a3 = svm->a3.value/32.0; m->b3 = svm->b3.value/32.0; m->c3 = svm->c3.value/32.0;
+	m->step_size = 0.01;
+	m->clean_steps = 0;
+}
+
+void learnFrom_MixedPrecision(SVM *svm, MasterWeights *m, Unit *x, Unit *y, int label) {
+	svm->forward(svm, x, y);
+	svm->backward(svm, label);
+
+	if(gradOverflowed(&svm->a1) || gradOverflowed(&svm->b1) || gradOverflowed(&svm->c1) ||
+	   gradOverflowed(&svm->a2) || gradOverflowed(&svm->b2) || gradOverflowed(&svm->c2) ||
+	   gradOverflowed(&svm->a3) || gradOverflowed(&svm->b3) || gradOverflowed(&svm->c3)) {
+		// skip the step and back off, like dynamic loss scaling in float16 training
+		if(svm->loss_scale > 1)
+			svm->loss_scale /= 2;
+		m->clean_steps = 0;
+		return;
+	}
+
+	// grad = real gradient * loss_scale, and the master weights are in real units
+	float step = m->step_size / svm->loss_scale;
+	updateMaster(&m->a1, &svm->a1, step);
+	updateMaster(&m->b1, &svm->b1, step);
+	updateMaster(&m->c1, &svm->c1, step);
+	updateMaster(&m->a2, &svm->a2, step);
+	updateMaster(&m->b2, &svm->b2, step);
+	updateMaster(&m->c2, &svm->c2, step);
+	updateMaster(&m->a3, &svm->a3, step);
+	updateMaster(&m->b3, &svm->b3, step);
+	updateMaster(&m->c3, &svm->c3, step);
+
+	if(++m->clean_steps >= 2000 && svm->loss_scale <= SHRT_MAX/2) {
+		svm->loss_scale *= 2;
+		m->clean_steps = 0;
+	}
+}
+
 float evalTrainingAccuracy(SVM *svm, char (*data)[2], char *labels, char len) {
 	float num_correct = 0;
 	Unit x;
@@ -344,42 +624,320 @@ float evalTrainingAccuracy(SVM *svm, char (*data)[2], char *labels, char len) {
 	return num_correct / len;
 };
 
-int Random_Test_XOR(SVM *svmXOR, char (*data)[2], char *labels, char len) {
+// Serving representation: the nine parameters in one contiguous array and
+// no Units, so a forward touches no grads, no gate state and zeroes nothing.
+// Gradients only exist in the SVM, which is the training workspace.
+typedef struct InferenceSVM {
+	signed char w[9]; // a1 b1 c1 a2 b2 c2 a3 b3 c3
+	const ActivationEntry *act[3];
+} InferenceSVM;
+
+void compile_InferenceSVM(InferenceSVM *inf, SVM *svm) {
+	inf->w[0] = svm->a1.value; inf->w[1] = svm->b1.value; inf->w[2] = svm->c1.value;
+	inf->w[3] = svm->a2.value; inf->w[4] = svm->b2.value; inf->w[5] = svm->c2.value;
+	inf->w[6] = svm->a3.value; inf->w[7] = svm->b3.value; inf->w[8] = svm->c3.value;
+	inf->act[0] = svm->circuit1.sGate.act->table;
+	inf->act[1] = svm->circuit2.sGate.act->table;
+	inf->act[2] = svm->circuit3.sGate.act->table;
+}
+
+// the same char truncations as the gates, so results match forward_SVM exactly
+signed char forward_InferenceCircuit(const signed char *w, const ActivationEntry *act, signed char x, signed char y) {
+	signed char ax = (w[0] * x)/32;
+	signed char by = (w[1] * y)/32;
+	signed char axpby = ax + by;
+	signed char axpbypc = axpby + w[2];
+	return act[axpbypc + 128].value;
+}
+
+signed char forward_InferenceSVM(const InferenceSVM *inf, signed char x, signed char y) {
+	signed char s1 = forward_InferenceCircuit(&inf->w[0], inf->act[0], x, y);
+	signed char s2 = forward_InferenceCircuit(&inf->w[3], inf->act[1], x, y);
+	return forward_InferenceCircuit(&inf->w[6], inf->act[2], s1, s2);
+}
+
+// correct predictions over n random inputs from the training distribution
+int countRandomCorrect(SVM *svmXOR, char (*data)[2], char *labels, int n) {
 	int num_correct = 0;
-	Unit *x = malloc(sizeof(Unit));
-	Unit *y = malloc(sizeof(Unit));
-	x->grad = 0;
-	y->grad = 0;
+	InferenceSVM model;
+	compile_InferenceSVM(&model, svmXOR);
 	char true_label;
-	int TESTNUM = 100000;
-	for(int iter = 0; iter < TESTNUM; iter++) {
+	for(int iter = 0; iter < n; iter++) {
 		int i = iter % 4;
 		//x->value = data[i][0]*32; //== 0 ? getRandomArbitrary(0, 0.2) : getRandomArbitrary(0.8, 1);
 		//y->value = data[i][1]*32; //== 0 ? getRandomArbitrary(0, 0.2) : getRandomArbitrary(0.8, 1);
-		x->value = data[i][0] == 0 ? getRandomArbitrary(0, 0.3) : getRandomArbitrary(0.7, 1);
-		y->value = data[i][1] == 0 ? getRandomArbitrary(0, 0.3) : getRandomArbitrary(0.7, 1);
-		Unit *xor2 = svmXOR->forward(svmXOR, x, y);
+		signed char x = data[i][0] == 0 ? getRandomArbitrary(0, 0.3) : getRandomArbitrary(0.7, 1);
+		signed char y = data[i][1] == 0 ? getRandomArbitrary(0, 0.3) : getRandomArbitrary(0.7, 1);
+		signed char xor2 = forward_InferenceSVM(&model, x, y);
 		true_label = labels[i];
-		//printf("xor2->value: %f\n", xor2->value/(32.0));
-		char predicted_label = xor2->value > 0.7*(32) ? 1 : 0;
+		//printf("xor2: %f\n", xor2/(32.0));
+		char predicted_label = xor2 > 0.7*(32) ? 1 : 0;
 		if(predicted_label == true_label) {
 			num_correct++;
 		}
 		else {
-			//printf("err: %d, %d %d %f\n", i, predicted_label, true_label, xor2->value/(32.0));
+			//printf("err: %d, %d %d %f\n", i, predicted_label, true_label, xor2/(32.0));
 		}
 	}
-	free(x); x = NULL;
-	free(y); y = NULL;
+	return num_correct;
+}
+
+int Random_Test_XOR(SVM *svmXOR, char (*data)[2], char *labels, char len) {
+	int TESTNUM = 100000;
+	int num_correct = countRandomCorrect(svmXOR, data, labels, TESTNUM);
+
+	printf("XOR-GATE 隨機輸入測試：%d/%d %s\n", num_correct, TESTNUM, (num_correct == TESTNUM ? "PASSED" : "")) ;
+	return (num_correct == TESTNUM);
+}
+
+// Models written by the float build's --calibrate. Unlike the Q5 chars
+// above, every circuit has its own power-of-two scale and values saturate
+// to a signed integer of the model's width instead of wrapping. The integer
+// arithmetic must stay identical to forward_QuantizedSVM in the float build,
+// which is what the calibration accuracy was measured with.
+typedef struct QuantCircuit {
+	int a, b, c;
+	int shift; // value = real * 2^shift
+} QuantCircuit;
+
+typedef struct QuantizedSVM {
+	QuantCircuit q1, q2, q3;
+	int bits;
+} QuantizedSVM;
+
+int quantMax(int bits) {
+	return (1 << (bits - 1)) - 1;
+}
+
+int saturate(int v, int bits) {
+	int qmax = quantMax(bits);
+	return v > qmax ? qmax : v < -qmax - 1 ? -qmax - 1 : v;
+}
+
+int quantize(float v, int shift, int bits) {
+	return saturate((int)lrintf(v * (1 << shift)), bits);
+}
+
+int rescale(int v, int from, int to, int bits) {
+	return saturate(to > from ? v * (1 << (to - from)) : v / (1 << (from - to)), bits);
+}
+
+int forward_QuantCircuit(const QuantCircuit *q, int x, int y, int bits) {
+	int one = 1 << q->shift;
+	int sum = (q->a * x) / one + (q->b * y) / one + q->c;
+	return saturate(sum > one ? one : sum > 0 ? sum : 0, bits);
+}
+
+float forward_QuantizedSVM(const QuantizedSVM *q, float x, float y) {
+	int s1 = forward_QuantCircuit(&q->q1, quantize(x, q->q1.shift, q->bits), quantize(y, q->q1.shift, q->bits), q->bits);
+	int s2 = forward_QuantCircuit(&q->q2, quantize(x, q->q2.shift, q->bits), quantize(y, q->q2.shift, q->bits), q->bits);
+	int out = forward_QuantCircuit(&q->q3,
+		rescale(s1, q->q1.shift, q->q3.shift, q->bits),
+		rescale(s2, q->q2.shift, q->q3.shift, q->bits), q->bits);
+	return out / (float)(1 << q->q3.shift);
+}
+
+int readQuantCircuit(FILE *fp, QuantCircuit *q, int bits) {
+	if(fscanf(fp, "%d %d %d %d", &q->shift, &q->a, &q->b, &q->c) != 4)
+		return 0;
+	return q->shift >= 0 && q->shift < bits && saturate(q->a, bits) == q->a &&
+		saturate(q->b, bits) == q->b && saturate(q->c, bits) == q->c;
+}
+
+int readQuantizedSVM(FILE *fp, QuantizedSVM *q) {
+	if(fscanf(fp, " bits %d", &q->bits) != 1 || q->bits < 2 || q->bits > 16)
+		return 0;
+	return readQuantCircuit(fp, &q->q1, q->bits) && readQuantCircuit(fp, &q->q2, q->bits) &&
+		readQuantCircuit(fp, &q->q3, q->bits);
+}
+
+// the float build's Random_Test_XOR, which is the test the calibration passed
+int Random_Test_QuantizedSVM(const QuantizedSVM *q) {
+	int data[4][2] = {{0,0}, {0,1}, {1,0}, {1,1}};
+	int labels[4] = {0, 1, 1, 0};
+	int num_correct = 0;
+	int TESTNUM = 1000000;
+	for(int iter = 0; iter < TESTNUM; iter++) {
+		int i = iter % 4;
+		float x = data[i][0] == 0 ? 0.2f * rand() / RAND_MAX : 0.8f + 0.2f * rand() / RAND_MAX;
+		float y = data[i][1] == 0 ? 0.2f * rand() / RAND_MAX : 0.8f + 0.2f * rand() / RAND_MAX;
+		int predicted_label = forward_QuantizedSVM(q, x, y) > 0.8 ? 1 : 0;
+		num_correct += predicted_label == labels[i];
+	}
 
 	printf("XOR-GATE 隨機輸入測試：%d/%d %s\n", num_correct, TESTNUM, (num_correct == TESTNUM ? "PASSED" : "")) ;
 	return (num_correct == TESTNUM);
 }
 
-int main(void) {
+void TestInferenceSVM() {
+	SVM svm; init_SVM(&svm);
+	svm.a3.value = 100; // large enough for the char sums to wrap, as they do in the gates
+	setActivation_Circuit(&svm.circuit2, &tanhActivation);
+	InferenceSVM model;
+	compile_InferenceSVM(&model, &svm);
+
+	Unit x = { .value = 0, 0 };
+	Unit y = { .value = 0, 0 };
+	for(int vx = -128; vx < 128; vx += 3) {
+		for(int vy = -128; vy < 128; vy += 5) {
+			x.value = vx;
+			y.value = vy;
+			signed char expected = svm.forward(&svm, &x, &y)->value;
+			assert(forward_InferenceSVM(&model, vx, vy) == expected);
+		}
+	}
+
+	printf("TestInferenceSVM [passed]\n");
+}
+
+void TestZeroAllocation() {
+	if(!allocHookLinked()) {
+		printf("TestZeroAllocation [skipped: link with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc]\n");
+		return;
+	}
+	SVM svm; init_SVM(&svm);
+
+	char data[4][2] = {{0,0}, {0,1}, {1,0}, {1,1}};
+	char labels[4] = {0, 1, 1, 0};
+	Unit x = { .value = 0, 0 };
+	Unit y = { .value = 0, 0 };
+
+	long before = alloc_count;
+	for(int iter=0; iter<1000; ++iter) {
+		int i = iter % 4;
+		x.value = data[i][0]*(32);
+		y.value = data[i][1]*(32);
+		svm.learnFrom(&svm, &x, &y, labels[i]);
+	}
+	evalTrainingAccuracy(&svm, data, labels, 4);
+	svm.forward(&svm, &x, &y);
+	assert(alloc_count == before);
+
+	printf("TestZeroAllocation [passed]\n");
+}
+
+void TestQuantizedSVM() {
+	FILE *fp = tmpfile();
+	assert(fp != NULL);
+	fprintf(fp, "bits 8\n6 6 13 19\n6 0 0 0\n5 0 0 0\n");
+	rewind(fp);
+	QuantizedSVM q;
+	assert(readQuantizedSVM(fp, &q));
+	// the float build's TestQuantizedCircuit: 0.1*0.1 + 0.2*0.3 + 0.3 at 6 bits
+	assert(forward_QuantCircuit(&q.q1, quantize(0.1, 6, 8), quantize(0.3, 6, 8), 8) == 22);
+	assert(rescale(64, 6, 5, 8) == 32 && rescale(127, 5, 6, 8) == 127);
+
+	// weights that do not fit the width are rejected
+	fclose(fp);
+	fp = tmpfile();
+	assert(fp != NULL);
+	fprintf(fp, "bits 4\n3 9 0 0\n3 0 0 0\n3 0 0 0\n");
+	rewind(fp);
+	assert(!readQuantizedSVM(fp, &q));
+	fclose(fp);
+
+	printf("TestQuantizedSVM [passed]\n");
+}
+
+void TestStochasticRounding() {
+	// 0.51 is 16.32 quanta, so on average one draw in three rounds up
+	float sum = 0;
+	for(int i = 0; i < 100000; i++) {
+		signed char q = stochasticRound(0.51);
+		assert(q == 16 || q == 17);
+		sum += q;
+	}
+	assert(fabs(sum/100000 - 16.32) < 0.02);
+	assert(stochasticRound(10.0) == 127);
+	assert(stochasticRound(-10.0) == -128);
+
+	printf("TestStochasticRounding [passed]\n");
+}
+
+void TestMixedPrecisionGrad() {
+	Circuit *circuit = new_Circuit();
+	setGradShift_Circuit(circuit, 5);
+
+	Unit a = { .value = (32)*0.5, 0 };
+	Unit b = { .value = (32)*0.25, 0 };
+	Unit c = { .value = (32)*0.1, 0 };
+	Unit x = { .value = (32)*0.5, 0 };
+	Unit y = { .value = (32)*1.0, 0 };
+
+	circuit->forward(circuit, &x, &y, &a, &b, &c);
+	circuit->backward(circuit, 1024);
+
+	// with a Q5 shift the grads are the real gradient times the top gradient
+	assert(a.grad == 512);
+	assert(b.grad == 1024);
+	assert(c.grad == 1024);
+	assert(x.grad == 512);
+
+	free(circuit);
+
+	printf("TestMixedPrecisionGrad [passed]\n");
+}
+
+// smoke check that --mixed still converges: fixed seeds keep it
+// deterministic, and about half of all mixed runs pass Random_Test_XOR,
+// as many as float trained with the same margins
+void TestMixedPrecisionConvergence() {
+	char data[4][2] = {{0,0}, {0,1}, {1,0}, {1,1}};
+	char labels[4] = {0, 1, 1, 0};
+	int passed = 0;
+	for(unsigned seed = 1; seed <= 16; seed++) {
+		srand(seed);
+		SVM svm; init_SVM(&svm);
+		MasterWeights master;
+		init_MixedPrecision(&svm, &master);
+		Unit x = { .value = 0, 0 };
+		Unit y = { .value = 0, 0 };
+		for(int iter = 0; iter < 100000; iter++) {
+			int i = rand() % 4;
+			x.value = data[i][0] == 0 ? getRandomArbitrary(0, 0.3) : getRandomArbitrary(0.7, 1);
+			x.grad = 0;
+			y.value = data[i][1] == 0 ? getRandomArbitrary(0, 0.3) : getRandomArbitrary(0.7, 1);
+			y.grad = 0;
+			learnFrom_MixedPrecision(&svm, &master, &x, &y, labels[i]);
+		}
+		passed += countRandomCorrect(&svm, data, labels, 100000) == 100000;
+	}
+	assert(passed >= 4);
+	srand(time(0));
+
+	printf("TestMixedPrecisionConvergence [passed]\n");
+}
+
+int main(int argc, char **argv) {
 	srand(time(0));
 
 	TestCircuit();
+	TestActivations();
+	TestZeroAllocation();
+	TestInferenceSVM();
+	TestStochasticRounding();
+	TestMixedPrecisionGrad();
+	TestMixedPrecisionConvergence();
+	TestQuantizedSVM();
+
+	// --model PATH runs a model written by the float build's --calibrate
+	if(argc > 2 && strcmp(argv[1], "--model") == 0) {
+		FILE *fp = fopen(argv[2], "r");
+		QuantizedSVM q;
+		if(fp == NULL || !readQuantizedSVM(fp, &q)) {
+			printf("cannot load %s\n", argv[2]);
+			if(fp != NULL)
+				fclose(fp);
+			return 1;
+		}
+		fclose(fp);
+		printf("int%d model, shifts %d/%d/%d\n", q.bits, q.q1.shift, q.q2.shift, q.q3.shift);
+		return !Random_Test_QuantizedSVM(&q);
+	}
+
+	// --mixed trains with float master weights instead of the all-char update
+	int mixed = argc > 1 && strcmp(argv[1], "--mixed") == 0;
+	MasterWeights master;
 
 	SVM svmXOR; init_SVM(&svmXOR);
 	
@@ -400,6 +958,8 @@ int main(void) {
 		failcnt = 0;
 		do {
 			init_SVM(&svmXOR);
+			if(mixed)
+				init_MixedPrecision(&svmXOR, &master);
 			for(int svmCnt=0; svmCnt<1; ++svmCnt) {
 				SVM *svm = svmList[svmCnt];
 				char *labels = labelList[svmCnt];
@@ -412,7 +972,10 @@ int main(void) {
 					x.value = x.value == 0 ? getRandomArbitrary(0, 0.3) : getRandomArbitrary(0.7, 1);
 					y.value = y.value == 0 ? getRandomArbitrary(0, 0.3) : getRandomArbitrary(0.7, 1);
 					//printf("x=%d y=%d\n", x.value, y.value);
-					svm->learnFrom(svm, &x, &y, labels[i]);
+					if(mixed)
+						learnFrom_MixedPrecision(svm, &master, &x, &y, labels[i]);
+					else
+						svm->learnFrom(svm, &x, &y, labels[i]);
 
 					if(0 && iter % 250 == 0) {
 						float errRate = evalTrainingAccuracy(svm, data, labels, 4);